@@ -0,0 +1,225 @@
+#ifndef BALANCER_HPP__
+#define BALANCER_HPP__
+
+#include "basic.hpp"
+
+#include <chrono>
+#include <stdexcept>
+
+namespace mux
+{
+
+class backend : public std::enable_shared_from_this<backend>
+{
+    using clock = std::chrono::steady_clock;
+
+    boost::asio::io_context& io_context_;
+    std::string host_, port_;
+    boost::asio::ip::tcp::resolver resolver_;
+    boost::asio::ip::tcp::resolver::results_type endpoints_;
+    boost::asio::steady_timer resolve_timer_, health_timer_;
+    boost::asio::ip::tcp::socket health_socket_;   // the check in flight, closed by stop()
+    boost::asio::steady_timer health_deadline_;
+    std::chrono::seconds resolve_interval_, health_interval_;
+    std::size_t active_ = 0;
+    bool healthy_ = true;
+    bool stopped_ = false;
+    double latency_ = 0; // EWMA of connect time in microseconds, 0 until measured
+
+    void start_resolve()
+    {
+        if (stopped_)
+            return;
+        resolve_timer_.expires_after(resolve_interval_);
+        resolve_timer_.async_wait(
+            [this, self=shared_from_this()] (boost::system::error_code const & error) {
+                if (error)
+                    return;
+                resolver_.async_resolve(
+                    host_, port_,
+                    [this, self] (boost::system::error_code const & error,
+                                  boost::asio::ip::tcp::resolver::results_type results) {
+                        if (error)
+                            BOOST_LOG_TRIVIAL(warning) << "[remote] resolve " << name() << " error: " << error.message()
+                                                       << ", keep cached endpoints";
+                        else
+                            endpoints_ = results;
+                        start_resolve();
+                    });
+            });
+    }
+
+    void start_health_check()
+    {
+        if (stopped_)
+            return;
+        health_timer_.expires_after(health_interval_);
+        health_timer_.async_wait(
+            [this, self=shared_from_this()] (boost::system::error_code const & error) {
+                if (error)
+                    return;
+                health_deadline_.expires_after(health_interval_);
+                health_deadline_.async_wait(
+                    [this, self] (boost::system::error_code const & error) {
+                        boost::system::error_code ec;
+                        if (not error)
+                            health_socket_.close(ec);
+                    });
+
+                auto start = clock::now();
+                boost::asio::async_connect(
+                    health_socket_, endpoints_,
+                    [this, self, start] (boost::system::error_code const & error,
+                                         boost::asio::ip::tcp::endpoint) {
+                        boost::system::error_code ec;
+                        health_deadline_.cancel();
+                        health_socket_.close(ec);
+                        if (stopped_)
+                            return;
+                        report(not error, clock::now() - start);
+                        start_health_check();
+                    });
+            });
+    }
+
+public:
+    backend(boost::asio::io_context& io, std::string const & host, std::string const & port):
+        io_context_{io},
+        host_{host},
+        port_{port},
+        resolver_{io},
+        resolve_timer_{io},
+        health_timer_{io},
+        health_socket_{io},
+        health_deadline_{io} {}
+
+    void start(std::chrono::seconds resolve_interval, std::chrono::seconds health_interval)
+    {
+        resolve_interval_ = resolve_interval;
+        health_interval_ = health_interval;
+
+        boost::system::error_code ec;
+        endpoints_ = resolver_.resolve(host_, port_, ec);
+        if (ec)
+        {
+            BOOST_LOG_TRIVIAL(error) << "[remote] resolve " << name() << " error: " << ec.message();
+            healthy_ = false;
+        }
+
+        if (resolve_interval_.count() > 0)
+            start_resolve();
+        if (health_interval_.count() > 0)
+            start_health_check();
+    }
+
+    void stop()
+    {
+        stopped_ = true;
+        resolve_timer_.cancel();
+        health_timer_.cancel();
+        resolver_.cancel();
+        boost::system::error_code ec;
+        health_socket_.close(ec);
+        health_deadline_.cancel();
+    }
+
+    void report(bool ok, clock::duration elapsed)
+    {
+        if (ok)
+        {
+            double us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+            latency_ = latency_ == 0 ? us : 0.7 * latency_ + 0.3 * us;
+        }
+
+        if (ok != healthy_)
+            BOOST_LOG_TRIVIAL(info) << "[remote] backend " << name() << (ok ? " up" : " down");
+        healthy_ = ok;
+    }
+
+    void acquire() { active_++; }
+    void release() { active_--; }
+
+    auto endpoints() -> boost::asio::ip::tcp::resolver::results_type const & { return endpoints_; }
+    auto name() const -> std::string { return host_ + ":" + port_; }
+    auto healthy() const -> bool { return healthy_; }
+    auto active() const -> std::size_t { return active_; }
+    auto latency() const -> double { return latency_; }
+};
+
+using backend_ptr = std::shared_ptr<backend>;
+
+class balancer
+{
+public:
+    enum class policy { least_conn, latency };
+
+private:
+    std::vector<backend_ptr> backends_;
+    policy policy_;
+    std::size_t next_ = 0; // rotates ties so idle backends share the load
+
+    template<typename Cost>
+    auto pick_min(bool any_healthy, Cost cost) -> backend_ptr
+    {
+        backend_ptr best;
+        double best_cost = 0;
+        for (std::size_t i = 0; i < backends_.size(); i++)
+        {
+            backend_ptr const & b = backends_[(next_ + i) % backends_.size()];
+            if (any_healthy and not b->healthy())
+                continue;
+            double c = cost(*b);
+            if (not best or c < best_cost)
+            {
+                best = b;
+                best_cost = c;
+            }
+        }
+        next_++;
+        return best;
+    }
+
+public:
+    balancer(policy p): policy_{p} {}
+
+    static auto parse_policy(std::string const & name) -> policy
+    {
+        if (name == "least-conn")
+            return policy::least_conn;
+        if (name == "latency")
+            return policy::latency;
+        throw std::invalid_argument("unknown balance policy: " + name);
+    }
+
+    void add(backend_ptr b) { backends_.push_back(b); }
+
+    /* backends that are down are skipped unless every backend is down */
+    auto pick() -> backend_ptr
+    {
+        if (backends_.empty())
+            return nullptr;
+
+        bool any_healthy = std::any_of(backends_.begin(), backends_.end(),
+                                       [] (backend_ptr const & b) { return b->healthy(); });
+        switch (policy_)
+        {
+        case policy::latency:
+            return pick_min(any_healthy, [] (backend const & b) { return (b.latency() + 1) * (b.active() + 1); });
+        case policy::least_conn:
+        default:
+            return pick_min(any_healthy, [] (backend const & b) { return static_cast<double>(b.active()); });
+        }
+    }
+
+    void stop()
+    {
+        for (backend_ptr const & b : backends_)
+            b->stop();
+    }
+
+    auto size() const -> std::size_t { return backends_.size(); }
+};
+
+} // namespace mux
+
+#endif // BALANCER_HPP__
@@ -38,6 +38,13 @@ int constexpr headersize = sizeof (channel_id_t) + sizeof (length_t);
 int constexpr bufsize = 4096;
 int constexpr bodysize = bufsize - headersize;
 
+/* a stream body never exceeds bodysize, so the top bit of the length marks a datagram frame,
+ * whose body is a whole datagram of up to datagram_bodysize bytes.
+ * length 0 without the flag closes a stream channel; with the flag it is an empty datagram. */
+length_t constexpr datagram_flag = 0x8000;
+int constexpr datagram_bodysize = datagram_flag - 1;
+int constexpr datagram_bufsize = datagram_bodysize + 1; // receive buffer; the spare byte shows a datagram did not fit
+
 using header_buf = std::array<std::uint8_t, headersize>;
 using header_buf_ptr = std::shared_ptr<header_buf>;
 using chunk = std::vector<std::uint8_t>;
@@ -66,6 +73,19 @@ void encode_header(chunk_ptr buf, channel_id_t channel, length_t size)
     std::memcpy(buf->data() + sizeof channel, &size, sizeof size);
 }
 
+bool datagram_fits(std::size_t received)
+{
+    return received <= static_cast<std::size_t>(datagram_bodysize);
+}
+
+/* frame the first size bytes of a datagram receive buffer */
+auto encode_datagram(chunk const & buf, std::size_t size, channel_id_t channel) -> chunk_ptr
+{
+    chunk_ptr chk = std::make_shared<chunk>(buf.begin(), buf.begin() + size);
+    encode_header(chk, channel, size | datagram_flag);
+    return chk;
+}
+
 bool is_common_error(boost::system::error_code const &error)
 {
     return
@@ -0,0 +1,113 @@
+#ifndef HANDOFF_HPP__
+#define HANDOFF_HPP__
+
+#include "basic.hpp"
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+#define MUX_HAS_HANDOFF 1
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // macOS: no flag, send_fd sets SO_NOSIGPIPE instead
+#endif
+
+namespace mux
+{
+
+/* bound blocking connect/sendmsg/recvmsg on a unix socket */
+void set_timeout(int sock, std::chrono::seconds timeout, boost::system::error_code & ec)
+{
+    timeval tv {};
+    tv.tv_sec = timeout.count();
+    if (::setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv) < 0 ||
+        ::setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv) < 0)
+        ec.assign(errno, boost::system::system_category());
+    else
+        ec.clear();
+}
+
+/* pass a file descriptor over a connected unix socket with SCM_RIGHTS.
+ * one dummy byte is sent along since some systems drop empty messages.
+ * fd < 0 sends the byte alone, telling the peer there is nothing to pass. */
+void send_fd(int sock, int fd, boost::system::error_code & ec)
+{
+    char dummy = 'F';
+    iovec iov {&dummy, sizeof dummy};
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof fd)] = {};
+    msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0)
+    {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof fd);
+        std::memcpy(CMSG_DATA(cmsg), &fd, sizeof fd);
+    }
+
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    ::setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof on);
+#endif
+
+    ssize_t n = 0;
+    do {
+        n = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0)
+        ec.assign(errno, boost::system::system_category());
+    else
+        ec.clear();
+}
+
+/* returns -1 with no error if the peer had nothing to pass */
+auto receive_fd(int sock, boost::system::error_code & ec) -> int
+{
+    char dummy = 0;
+    iovec iov {&dummy, sizeof dummy};
+
+    int fd = -1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof fd)] = {};
+    msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    ssize_t n = 0;
+    do {
+        n = ::recvmsg(sock, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0)
+    {
+        ec.assign(errno, boost::system::system_category());
+        return -1;
+    }
+    if (n == 0)
+    {
+        ec = boost::asio::error::eof;
+        return -1;
+    }
+
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            std::memcpy(&fd, CMSG_DATA(cmsg), sizeof fd);
+
+    ec.clear();
+    return fd;
+}
+
+} // namespace mux
+
+#endif // BOOST_ASIO_HAS_LOCAL_SOCKETS
+#endif // HANDOFF_HPP__
@@ -1,8 +1,10 @@
 #include "basic.hpp"
 #include "queued_stream.hpp"
+#include "handoff.hpp"
 
 #include <iostream>
 #include <random>
+#include <map>
 
 template<typename Server>
 class connection : public mux::queued_stream<boost::asio::ip::tcp::socket>
@@ -59,9 +61,11 @@ public:
                                   self->socket_.close();
                                   self->queued_stream::close();
                                   self->is_closed_ = true;
+                                  self->server_.channel_closed();
                               });
     }
 
+    auto is_open() -> bool { return socket_.is_open(); }
     auto socket() -> boost::asio::ip::tcp::socket& { return socket_; }
     auto channel() -> mux::channel_id_t { return channel_; }
 };
@@ -74,17 +78,32 @@ class server
     std::uniform_int_distribution<mux::channel_id_t> distrib{0, std::numeric_limits<mux::channel_id_t>::max()};
     std::unordered_map<mux::channel_id_t, std::shared_ptr<connection<server>>> channel_used_;
 
+    /* datagram channels: one per client address, dropped after datagram_timeout_ without traffic */
+    struct datagram_peer
+    {
+        boost::asio::ip::udp::endpoint endpoint;
+        std::chrono::steady_clock::time_point last_active;
+    };
+    std::map<boost::asio::ip::udp::endpoint, mux::channel_id_t> datagram_channel_;
+    std::unordered_map<mux::channel_id_t, datagram_peer> datagram_used_;
+
     auto rand() -> mux::channel_id_t { return distrib(gen); }
-    auto get_unused_channel() -> std::shared_ptr<connection<server>>
+    auto get_unused_id() -> mux::channel_id_t
     {
         mux::channel_id_t id = 0;
         bool found = false;
         do {
             id = rand();
 
-            found = channel_used_.find(id) != channel_used_.end();
+            found = channel_used_.find(id) != channel_used_.end() ||
+                    datagram_used_.find(id) != datagram_used_.end();
         } while (found);
+        return id;
+    }
 
+    auto get_unused_channel() -> std::shared_ptr<connection<server>>
+    {
+        mux::channel_id_t id = get_unused_id();
         auto conn = std::make_shared<connection<server>>(io_context_, id, *this);
         channel_used_.insert({id, conn->cast_shared_from_this<connection<server>>()});
         return conn;
@@ -93,26 +112,199 @@ class server
 private:
     boost::asio::io_context &io_context_;
     boost::asio::io_context::strand io_strand_;
+    int port_;
     boost::asio::ip::tcp::acceptor acceptor_;
     boost::process::async_pipe process_output_, process_input_;
     boost::process::child process_;
     mux::queued_stream_ptr<decltype(process_input_)> managed_stream_;
 
+    /* drain: stop accepting, wait for open channels up to drain_timeout_, then exit */
+    bool draining_ = false;
+    bool failed_ = false;
+    std::chrono::seconds drain_timeout_;
+    boost::asio::steady_timer drain_timer_;
+
+    int datagram_port_;
+    boost::asio::ip::udp::socket datagram_socket_;
+    mux::chunk datagram_buf_ = mux::chunk(mux::datagram_bufsize);
+    std::chrono::seconds datagram_timeout_;
+    boost::asio::steady_timer datagram_timer_;
+
+#ifdef MUX_HAS_HANDOFF
+    /* takeover: wait until remote answers a probe, then fetch the listening socket from takeover_path_ */
+    std::string takeover_path_, handoff_path_;
+    std::chrono::seconds ready_timeout_;
+    boost::asio::steady_timer ready_timer_;
+    bool probing_ = false;
+    mux::channel_id_t probe_channel_ = 0;
+    boost::asio::local::stream_protocol::acceptor handoff_acceptor_;
+    boost::asio::signal_set signals_;
+#endif
+
 public:
-    server(boost::asio::io_context & io, int port, std::string const & cmd):
+    struct options
+    {
+        std::chrono::seconds drain_timeout;
+        std::chrono::seconds ready_timeout;
+        std::string takeover_path;
+        std::string handoff_path;
+        int datagram_port = 0;
+        std::chrono::seconds datagram_timeout;
+    };
+
+    server(boost::asio::io_context & io, int port, std::string const & cmd, options const & opt):
         io_context_{io},
         io_strand_{io},
-        acceptor_{io, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)},
+        port_{port},
+        acceptor_{io},
         process_output_{io},
         process_input_{io},
         process_(cmd,
                  boost::process::std_out > process_output_,
                  boost::process::std_in < process_input_,
                  io),
-        managed_stream_{std::make_shared<mux::queued_stream<decltype(process_input_)>>(io, process_input_)}
+        managed_stream_{std::make_shared<mux::queued_stream<decltype(process_input_)>>(io, process_input_)},
+        drain_timeout_{opt.drain_timeout},
+        drain_timer_{io},
+        datagram_port_{opt.datagram_port},
+        datagram_socket_{io},
+        datagram_timeout_{opt.datagram_timeout},
+        datagram_timer_{io}
+#ifdef MUX_HAS_HANDOFF
+        ,
+        takeover_path_{opt.takeover_path},
+        handoff_path_{opt.handoff_path},
+        ready_timeout_{opt.ready_timeout},
+        ready_timer_{io},
+        handoff_acceptor_{io},
+        signals_{io, SIGUSR2}
+#endif
     {
-        start_accept();
         start_read_process();
+#ifdef MUX_HAS_HANDOFF
+        start_wait_signal();
+        if (not takeover_path_.empty())
+        {
+            start_probe();
+            return;
+        }
+#endif
+        listen();
+        listen_datagram();
+        start_accept();
+        start_datagram();
+#ifdef MUX_HAS_HANDOFF
+        start_handoff();
+#endif
+    }
+
+    void listen()
+    {
+        boost::asio::ip::tcp::endpoint endpoint{boost::asio::ip::tcp::v4(), static_cast<unsigned short>(port_)};
+        acceptor_.open(endpoint.protocol());
+        acceptor_.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+        acceptor_.bind(endpoint);
+        acceptor_.listen();
+    }
+
+    void listen_datagram()
+    {
+        if (datagram_port_ == 0)
+            return;
+
+        boost::asio::ip::udp::endpoint endpoint{boost::asio::ip::udp::v4(), static_cast<unsigned short>(datagram_port_)};
+        datagram_socket_.open(endpoint.protocol());
+        datagram_socket_.bind(endpoint);
+    }
+
+    void start_datagram()
+    {
+        if (not datagram_socket_.is_open())
+            return;
+
+        start_read_datagram();
+        start_expire_datagram();
+    }
+
+    void start_read_datagram()
+    {
+        auto sender = std::make_shared<boost::asio::ip::udp::endpoint>();
+        datagram_socket_.async_receive_from(
+            boost::asio::buffer(datagram_buf_.data(), datagram_buf_.size()),
+            *sender,
+            [sender, this] (boost::system::error_code const & error,
+                            std::size_t bytes_transferred) {
+                if (error == boost::asio::error::operation_aborted or error == boost::asio::error::bad_descriptor)
+                    return;
+
+                if (error)
+                    BOOST_LOG_TRIVIAL(error) << "[multiplex] datagram read error: " << error.message();
+                else if (not mux::datagram_fits(bytes_transferred))
+                    BOOST_LOG_TRIVIAL(warning) << "[multiplex] drop datagram from " << *sender
+                                               << " larger than " << mux::datagram_bodysize << " bytes";
+                else
+                    post(mux::encode_datagram(datagram_buf_, bytes_transferred, get_datagram_channel(*sender)));
+                start_read_datagram();
+            });
+    }
+
+    auto get_datagram_channel(boost::asio::ip::udp::endpoint const & endpoint) -> mux::channel_id_t
+    {
+        mux::channel_id_t id = 0;
+        auto it = datagram_channel_.find(endpoint);
+        if (it == datagram_channel_.end())
+        {
+            id = get_unused_id();
+            BOOST_LOG_TRIVIAL(trace) << "[multiplex] new datagram channel: " << id << " for " << endpoint;
+            datagram_channel_.emplace(endpoint, id);
+            datagram_used_.emplace(id, datagram_peer{endpoint, {}});
+        }
+        else
+            id = it->second;
+
+        datagram_used_[id].last_active = std::chrono::steady_clock::now();
+        return id;
+    }
+
+    void send_datagram(mux::channel_id_t chan, mux::chunk_ptr buf)
+    {
+        auto it = datagram_used_.find(chan);
+        if (it == datagram_used_.end())
+            return;
+
+        it->second.last_active = std::chrono::steady_clock::now();
+        datagram_socket_.async_send_to(
+            boost::asio::buffer(buf->data(), buf->size()),
+            it->second.endpoint,
+            [buf] (boost::system::error_code const & error, std::size_t) {
+                if (error and not mux::is_common_error(error))
+                    BOOST_LOG_TRIVIAL(error) << "[multiplex] datagram send error: " << error.message();
+            });
+    }
+
+    void start_expire_datagram()
+    {
+        datagram_timer_.expires_after(datagram_timeout_);
+        datagram_timer_.async_wait(
+            [this] (boost::system::error_code const & error) {
+                if (error)
+                    return;
+
+                auto deadline = std::chrono::steady_clock::now() - datagram_timeout_;
+                for (auto it = datagram_used_.begin(); it != datagram_used_.end();)
+                {
+                    if (it->second.last_active < deadline)
+                    {
+                        BOOST_LOG_TRIVIAL(trace) << "[multiplex] expired datagram channel: " << it->first;
+                        datagram_channel_.erase(it->second.endpoint);
+                        it = datagram_used_.erase(it);
+                    }
+                    else
+                        ++it;
+                }
+                channel_closed();
+                start_expire_datagram();
+            });
     }
 
     void start_accept()
@@ -124,13 +316,288 @@ public:
             conn->socket(),
             [this, conn] (boost::system::error_code const& error) {
                 if (error)
-                    BOOST_LOG_TRIVIAL(error) << error.message();
+                {
+                    if (not mux::is_common_error(error))
+                        BOOST_LOG_TRIVIAL(error) << error.message();
+                    remove_channel(conn->channel());
+                }
                 else
                     conn->start_read_socket();
-                start_accept();
+
+                if (not draining_)
+                    start_accept();
+            });
+    }
+
+    /* after a handoff the successor reads the shared udp socket, so we only stop reading
+     * and keep it to answer clients whose queries are still in flight */
+    void start_drain(bool handed_off)
+    {
+        if (draining_)
+            return;
+
+        BOOST_LOG_TRIVIAL(info) << "[multiplex] draining, timeout: " << drain_timeout_.count() << "s";
+        draining_ = true;
+        boost::system::error_code ec;
+        acceptor_.close(ec);
+        if (handed_off)
+            datagram_socket_.cancel(ec);
+        else
+        {
+            datagram_socket_.close(ec);
+            datagram_channel_.clear();
+            datagram_used_.clear();
+        }
+#ifdef MUX_HAS_HANDOFF
+        handoff_acceptor_.close(ec);
+        signals_.cancel(ec);
+#endif
+        drain_timer_.expires_after(drain_timeout_);
+        drain_timer_.async_wait(
+            [this] (boost::system::error_code const & error) {
+                if (error)
+                    return;
+                BOOST_LOG_TRIVIAL(warning) << "[multiplex] drain timeout, channels left: " << open_channels();
+                shutdown();
             });
+        channel_closed();
     }
 
+    void channel_closed()
+    {
+        if (draining_ and open_channels() == 0)
+        {
+            BOOST_LOG_TRIVIAL(info) << "[multiplex] drained";
+            shutdown();
+        }
+    }
+
+    auto open_channels() -> std::size_t
+    {
+        auto deadline = std::chrono::steady_clock::now() - datagram_timeout_;
+        return std::count_if(channel_used_.begin(), channel_used_.end(),
+                             [] (auto const & p) { return p.second->is_open(); }) +
+               std::count_if(datagram_used_.begin(), datagram_used_.end(),
+                             [deadline] (auto const & p) { return p.second.last_active >= deadline; });
+    }
+
+    auto failed() -> bool { return failed_; }
+
+    void shutdown()
+    {
+        drain_timer_.cancel();
+        std::error_code ec;
+        process_.terminate(ec);
+        io_context_.stop();
+    }
+
+#ifdef MUX_HAS_HANDOFF
+    void start_wait_signal()
+    {
+        signals_.async_wait(
+            [this] (boost::system::error_code const & error, int signal) {
+                if (error)
+                    return;
+                BOOST_LOG_TRIVIAL(info) << "[multiplex] received signal " << signal;
+                start_drain(false);
+            });
+    }
+
+    /* an empty frame on a channel remote never saw is echoed back,
+     * so the reply tells us the ssh session is up end to end */
+    void start_probe()
+    {
+        probing_ = true;
+        probe_channel_ = get_unused_id();
+        BOOST_LOG_TRIVIAL(info) << "[multiplex] waiting for remote before takeover";
+
+        mux::chunk_ptr buf = std::make_shared<mux::chunk>();
+        mux::encode_header(buf, probe_channel_, 0);
+        post(buf);
+
+        ready_timer_.expires_after(ready_timeout_);
+        ready_timer_.async_wait(
+            [this] (boost::system::error_code const & error) {
+                if (error or not probing_)
+                    return;
+                BOOST_LOG_TRIVIAL(warning) << "[multiplex] no reply from remote, taking over anyway";
+                probe_done();
+            });
+    }
+
+    void probe_done()
+    {
+        probing_ = false;
+        ready_timer_.cancel();
+        if (not take_over())
+            return;
+        start_accept();
+        start_datagram();
+        start_handoff();
+    }
+
+    auto take_over() -> bool
+    {
+        boost::system::error_code ec;
+        boost::asio::local::stream_protocol::socket sock{io_context_};
+        sock.open(boost::asio::local::stream_protocol(), ec);
+        if (not ec)
+            mux::set_timeout(sock.native_handle(), ready_timeout_, ec);
+        if (not ec)
+            sock.connect(boost::asio::local::stream_protocol::endpoint{takeover_path_}, ec);
+
+        int fd = -1;
+        if (not ec)
+            fd = mux::receive_fd(sock.native_handle(), ec);
+        if (not ec and fd < 0)
+            ec = boost::system::errc::make_error_code(boost::system::errc::bad_message);
+
+        if (not ec)
+            acceptor_.assign(boost::asio::ip::tcp::v4(), fd, ec);
+
+        bool taken_over = not ec;
+
+        if (ec)
+        {
+            BOOST_LOG_TRIVIAL(warning) << "[multiplex] takeover from " << takeover_path_ << " failed: " << ec.message()
+                                       << ", listen on " << port_ << " instead";
+            if (fd >= 0)
+                ::close(fd);
+            if (not try_listen([this] { listen(); }))
+                return false;
+        }
+        else
+            BOOST_LOG_TRIVIAL(info) << "[multiplex] took over listening socket from " << takeover_path_;
+
+        // the old process always sends a second message: its udp socket, or a bare byte if it has none
+        fd = -1;
+        if (not ec)
+            fd = mux::receive_fd(sock.native_handle(), ec);
+
+        if (datagram_port_ == 0)
+        {
+            if (fd >= 0)
+                ::close(fd);
+        }
+        else
+        {
+            if (not ec and fd >= 0)
+                datagram_socket_.assign(boost::asio::ip::udp::v4(), fd, ec);
+
+            if (ec or fd < 0)
+            {
+                if (ec)
+                    BOOST_LOG_TRIVIAL(warning) << "[multiplex] datagram takeover failed: " << ec.message()
+                                               << ", listen on " << datagram_port_ << " instead";
+                if (fd >= 0)
+                    ::close(fd);
+                if (not try_listen([this] { listen_datagram(); }))
+                    return false;
+            }
+        }
+
+        // the old process keeps serving until it reads this
+        if (taken_over)
+        {
+            char ack = 'A';
+            boost::asio::write(sock, boost::asio::buffer(&ack, sizeof ack), ec);
+            if (ec)
+                BOOST_LOG_TRIVIAL(warning) << "[multiplex] handoff ack failed: " << ec.message();
+        }
+        return true;
+    }
+
+    /* without a handoff the old process, if any, still holds the port */
+    template<typename Listen>
+    auto try_listen(Listen open_port) -> bool
+    {
+        try
+        {
+            open_port();
+            return true;
+        }
+        catch (boost::system::system_error const & e)
+        {
+            BOOST_LOG_TRIVIAL(error) << "[multiplex] old process did not offer a handoff on " << takeover_path_
+                                     << ": " << e.what();
+            failed_ = true;
+            shutdown();
+            return false;
+        }
+    }
+
+    void start_handoff()
+    {
+        if (handoff_path_.empty())
+            return;
+
+        ::unlink(handoff_path_.c_str());
+        boost::asio::local::stream_protocol::endpoint endpoint{handoff_path_};
+        handoff_acceptor_.open(endpoint.protocol());
+        handoff_acceptor_.bind(endpoint);
+        handoff_acceptor_.listen();
+        start_accept_handoff();
+    }
+
+    void start_accept_handoff()
+    {
+        handoff_acceptor_.async_accept(
+            [this] (boost::system::error_code const & error,
+                    boost::asio::local::stream_protocol::socket peer) {
+                if (error)
+                {
+                    if (not mux::is_common_error(error))
+                        BOOST_LOG_TRIVIAL(error) << "[multiplex] handoff accept error: " << error.message();
+                    return;
+                }
+
+                boost::system::error_code ec;
+                mux::send_fd(peer.native_handle(), acceptor_.native_handle(), ec);
+                if (not ec)
+                    mux::send_fd(peer.native_handle(),
+                                 datagram_socket_.is_open() ? datagram_socket_.native_handle() : -1, ec);
+                if (ec)
+                {
+                    BOOST_LOG_TRIVIAL(error) << "[multiplex] handoff error: " << ec.message();
+                    start_accept_handoff();
+                    return;
+                }
+
+                start_wait_handoff_ack(std::make_shared<boost::asio::local::stream_protocol::socket>(std::move(peer)));
+            });
+    }
+
+    /* keep accepting until the successor confirms it owns the sockets */
+    void start_wait_handoff_ack(std::shared_ptr<boost::asio::local::stream_protocol::socket> peer)
+    {
+        auto ack = std::make_shared<char>();
+        auto deadline = std::make_shared<boost::asio::steady_timer>(io_context_, ready_timeout_);
+        deadline->async_wait(
+            [peer] (boost::system::error_code const & error) {
+                boost::system::error_code ec;
+                if (not error)
+                    peer->close(ec);
+            });
+
+        boost::asio::async_read(
+            *peer,
+            boost::asio::buffer(ack.get(), sizeof *ack),
+            [this, peer, ack, deadline] (boost::system::error_code const & error, std::size_t) {
+                deadline->cancel();
+                if (error)
+                {
+                    BOOST_LOG_TRIVIAL(warning) << "[multiplex] successor did not confirm handoff: " << error.message()
+                                               << ", keep serving";
+                    start_accept_handoff();
+                    return;
+                }
+
+                BOOST_LOG_TRIVIAL(info) << "[multiplex] listening socket handed off";
+                start_drain(true);
+            });
+    }
+#endif
+
     void remove_channel(mux::channel_id_t id)
     {
         boost::asio::post(
@@ -161,8 +628,14 @@ public:
                 else
                 {
                     auto && [chan, size] = mux::decode_header(buf);
-                    if (size == 0)
+                    if (size & mux::datagram_flag)
+                        start_read_process_datagram(chan, size & ~mux::datagram_flag);
+                    else if (size == 0)
                     {
+#ifdef MUX_HAS_HANDOFF
+                        if (probing_ and chan == probe_channel_)
+                            probe_done();
+#endif
                         auto it = channel_used_.find(chan);
                         if (it != channel_used_.end())
                             it->second->close();
@@ -206,6 +679,30 @@ public:
             });
     }
 
+    void start_read_process_datagram(mux::channel_id_t chan, std::size_t bytes_transferred)
+    {
+        BOOST_LOG_TRIVIAL(trace) << "[multiplex] start_read_process_datagram, id: " << chan;
+        mux::chunk_ptr buf = std::make_shared<mux::chunk>(bytes_transferred);
+
+        boost::asio::async_read(
+            process_output_,
+            boost::asio::buffer(buf->data(), bytes_transferred),
+            [buf, chan, this] (boost::system::error_code const & error,
+                               std::size_t bytes_transferred) {
+                if (error)
+                {
+                    if (not mux::is_common_error(error))
+                        BOOST_LOG_TRIVIAL(error) << "[multiplex] process datagram read error: " << error.message();
+                    process_output_close();
+                }
+                else
+                {
+                    send_datagram(chan, buf);
+                    start_read_process();
+                }
+            });
+    }
+
     void process_output_close()
     {
         BOOST_LOG_TRIVIAL(trace) << "[multiplex] process_output_close";
@@ -223,12 +720,22 @@ int main(int argc, char* argv[])
         std::string run_argv;
         int listen_port;
         bool trace_log;
+        int drain_timeout = 30, ready_timeout = 10, datagram_timeout;
+        server::options opt;
         po::options_description desc("Allowed options");
         desc.add_options()
             ("help", "produce help message")
             ("run", po::value<std::string>(&run_argv)->required(), "For every connection, run this command and attach stdin/stdout")
             ("listen", po::value<int>(&listen_port)->required(), "listen on this port")
             ("trace", po::value<bool>(&trace_log)->default_value(false)->implicit_value(true), "print trace messages")
+            ("udp-listen", po::value<int>(&opt.datagram_port), "also listen on this udp port, one channel per client address")
+            ("udp-timeout", po::value<int>(&datagram_timeout)->default_value(30), "seconds before an idle udp client is forgotten")
+            ("drain-timeout", po::value<int>(&drain_timeout)->default_value(30), "seconds to wait for open channels when draining")
+#ifdef MUX_HAS_HANDOFF
+            ("handoff", po::value<std::string>(&opt.handoff_path), "hand the listening socket to a successor connecting to this unix socket, then drain. SIGUSR2 drains without handoff")
+            ("takeover", po::value<std::string>(&opt.takeover_path), "once the command is ready, take the listening socket from the process at this unix socket")
+            ("ready-timeout", po::value<int>(&ready_timeout)->default_value(10), "seconds to wait for the command to be ready before takeover, and for a successor to confirm a handoff")
+#endif
             ;
 
         po::positional_options_description p;
@@ -243,15 +750,27 @@ int main(int argc, char* argv[])
         }
 
         po::notify(vm);
+        if (drain_timeout <= 0)
+            throw std::invalid_argument("--drain-timeout must be positive");
+        if (ready_timeout <= 0)
+            throw std::invalid_argument("--ready-timeout must be positive");
+        if (datagram_timeout <= 0)
+            throw std::invalid_argument("--udp-timeout must be positive");
         if (trace_log)
             boost::log::core::get()->set_filter(boost::log::trivial::severity >= boost::log::trivial::trace);
 
+        opt.drain_timeout = std::chrono::seconds{drain_timeout};
+        opt.ready_timeout = std::chrono::seconds{ready_timeout};
+        opt.datagram_timeout = std::chrono::seconds{datagram_timeout};
+
         boost::asio::io_context io;
 
-        server s {io, listen_port, run_argv};
+        server s {io, listen_port, run_argv, opt};
 
         BOOST_LOG_TRIVIAL(info) << "Start handling requests";
         io.run();
+        if (s.failed())
+            return EXIT_FAILURE;
 
 //        boost::thread_group tg;
 //        for (int i = 0; i < std::thread::hardware_concurrency(); i++)
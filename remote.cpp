@@ -1,5 +1,6 @@
 #include "basic.hpp"
 #include "queued_stream.hpp"
+#include "balancer.hpp"
 
 #include <iostream>
 
@@ -11,6 +12,8 @@ class connection : public mux::queued_stream<boost::asio::ip::tcp::socket>
     boost::asio::ip::tcp::socket socket_;
     mux::channel_id_t channel_;
     Server & server_;
+    mux::backend_ptr backend_;
+    std::size_t attempts_ = 0;
     bool is_closed = false;
 
 public:
@@ -26,17 +29,39 @@ public:
 
     ~connection() { server_.remove_channel(channel_); }
 
-    void connect(boost::asio::ip::tcp::resolver::results_type endpoints_)
+    void connect(mux::backend_ptr backend)
     {
-        BOOST_LOG_TRIVIAL(trace) << "[remote] connect: " << channel_;
+        BOOST_LOG_TRIVIAL(trace) << "[remote] connect: " << channel_ << " to " << backend->name();
+        backend_ = backend;
+        backend_->acquire();
+        attempts_++;
+
+        auto start = std::chrono::steady_clock::now();
         boost::asio::async_connect(
             socket_,
-            endpoints_,
-            [self=this->cast_shared_from_this<this_t>()](boost::system::error_code const & error, boost::asio::ip::tcp::endpoint) {
+            backend->endpoints(),
+            [self=this->cast_shared_from_this<this_t>(), backend, start](boost::system::error_code const & error, boost::asio::ip::tcp::endpoint) {
+                // the channel closed while connecting; not the backend's fault
+                if (error == boost::asio::error::operation_aborted or self->is_closed)
+                {
+                    self->release_backend();
+                    return;
+                }
+
+                backend->report(not error, std::chrono::steady_clock::now() - start);
                 if (error)
                 {
-                    BOOST_LOG_TRIVIAL(error) << "[remote] connect error: " << error.message();
-                    self->close();
+                    BOOST_LOG_TRIVIAL(error) << "[remote] connect " << backend->name() << " error: " << error.message();
+                    self->release_backend();
+                    mux::backend_ptr next = self->server_.pick();
+                    if (not self->is_closed and next and self->attempts_ < self->server_.backend_count())
+                    {
+                        boost::system::error_code ec;
+                        self->socket_.close(ec);
+                        self->connect(next);
+                    }
+                    else
+                        self->close();
                 }
                 else
                 {
@@ -81,29 +106,125 @@ public:
                                   self->socket_.close();
                                   self->queued_stream::close();
                                   self->is_closed = true;
+                                  self->release_backend();
                               });
     }
 
+    void release_backend()
+    {
+        if (backend_)
+            backend_->release();
+        backend_.reset();
+    }
+
     auto socket() -> boost::asio::ip::tcp::socket& { return socket_; }
     auto channel() -> mux::channel_id_t { return channel_; }
 };
 
+template<typename Server>
+class datagram_connection : public std::enable_shared_from_this<datagram_connection<Server>>
+{
+    boost::asio::ip::udp::socket socket_;
+    mux::channel_id_t channel_;
+    Server & server_;
+    std::chrono::steady_clock::time_point last_active_;
+    mux::chunk buf_ = mux::chunk(mux::datagram_bufsize);
+
+public:
+    datagram_connection(boost::asio::io_context& io, mux::channel_id_t id, Server & s):
+        socket_{io},
+        channel_{id},
+        server_{s},
+        last_active_{std::chrono::steady_clock::now()} {}
+
+    auto connect(boost::asio::ip::udp::endpoint const & target) -> bool
+    {
+        BOOST_LOG_TRIVIAL(trace) << "[remote] datagram connect: " << channel_;
+        boost::system::error_code ec;
+        socket_.connect(target, ec);
+        if (ec)
+        {
+            BOOST_LOG_TRIVIAL(error) << "[remote] datagram connect error: " << ec.message();
+            return false;
+        }
+        start_read_socket();
+        return true;
+    }
+
+    void start_read_socket()
+    {
+        socket_.async_receive(
+            boost::asio::buffer(buf_.data(), buf_.size()),
+            [self=this->shared_from_this()] (boost::system::error_code const & error,
+                                             std::size_t bytes_transferred) {
+                if (error == boost::asio::error::operation_aborted or error == boost::asio::error::bad_descriptor)
+                    return;
+
+                // icmp port unreachable from an earlier datagram shows up here; keep reading
+                if (error)
+                    BOOST_LOG_TRIVIAL(error) << "[remote] datagram read error: " << error.message();
+                else if (not mux::datagram_fits(bytes_transferred))
+                    BOOST_LOG_TRIVIAL(warning) << "[remote] drop datagram larger than " << mux::datagram_bodysize << " bytes";
+                else
+                {
+                    self->last_active_ = std::chrono::steady_clock::now();
+                    self->server_.post(mux::encode_datagram(self->buf_, bytes_transferred, self->channel_));
+                }
+                self->start_read_socket();
+            });
+    }
+
+    void post(mux::chunk_ptr chk)
+    {
+        last_active_ = std::chrono::steady_clock::now();
+        socket_.async_send(
+            boost::asio::buffer(chk->data(), chk->size()),
+            [chk, self=this->shared_from_this()] (boost::system::error_code const & error, std::size_t) {
+                if (error and not mux::is_common_error(error))
+                    BOOST_LOG_TRIVIAL(error) << "[remote] datagram send error: " << error.message();
+            });
+    }
+
+    void close()
+    {
+        boost::system::error_code ec;
+        socket_.close(ec);
+    }
+
+    auto last_active() -> std::chrono::steady_clock::time_point { return last_active_; }
+};
+
 class server
 {
     boost::asio::io_context &io_context_;
-    boost::asio::ip::tcp::resolver::results_type endpoints_;
+    mux::balancer & balancer_;
     boost::asio::posix::stream_descriptor stdin_, stdout_;
     std::unordered_map<mux::channel_id_t, std::shared_ptr<connection<server>>> channel_used_;
     mux::queued_stream_ptr<decltype(stdout_)> managed_stream_;
 
+    /* datagram channels forward to datagram_targets_, one udp socket each, dropped after datagram_timeout_ idle */
+    boost::asio::ip::udp::resolver::results_type datagram_targets_;
+    std::unordered_map<mux::channel_id_t, std::shared_ptr<datagram_connection<server>>> datagram_used_;
+    std::chrono::seconds datagram_timeout_;
+    boost::asio::steady_timer datagram_timer_;
+    bool warned_no_datagram_target_ = false;
+
 public:
-    server(boost::asio::io_context & io, boost::asio::ip::tcp::resolver::results_type endpoints):
+    server(boost::asio::io_context & io, mux::balancer & b,
+           boost::asio::ip::udp::resolver::results_type datagram_targets, std::chrono::seconds datagram_timeout):
         io_context_{io},
-        endpoints_{endpoints},
+        balancer_{b},
         stdin_{io, ::dup(STDIN_FILENO)},
         stdout_{io, ::dup(STDOUT_FILENO)},
-        managed_stream_{std::make_shared<mux::queued_stream<decltype(stdout_)>>(io, stdout_)}
-    { start_read_stdin(); }
+        managed_stream_{std::make_shared<mux::queued_stream<decltype(stdout_)>>(io, stdout_)},
+        datagram_targets_{datagram_targets},
+        datagram_timeout_{datagram_timeout},
+        datagram_timer_{io}
+    {
+        start_read_stdin();
+        if (not datagram_targets_.empty())
+            start_expire_datagram();
+    }
 
     void start_read_stdin()
     {
@@ -123,11 +244,20 @@ public:
                 else
                 {
                     auto && [chan, size] = mux::decode_header(buf);
-                    if (size == 0)
+                    if (size & mux::datagram_flag)
+                        start_read_stdin_datagram(chan, size & ~mux::datagram_flag);
+                    else if (size == 0)
                     {
                         auto it = channel_used_.find(chan);
                         if (it != channel_used_.end())
                             it->second->close();
+                        else
+                        {
+                            // never seen: echo it so multiplex-tcp can probe that we are up
+                            mux::chunk_ptr reply = std::make_shared<mux::chunk>();
+                            mux::encode_header(reply, chan, 0);
+                            post(reply);
+                        }
                         start_read_stdin();
                     }
                     else
@@ -147,7 +277,7 @@ public:
             if (it == channel_used_.end())
             {
                 conn = std::make_shared<connection<server>>(io_context_, id, *this);
-                conn->connect(endpoints_);
+                conn->connect(pick());
                 channel_used_.insert({id, conn});
             }
             else
@@ -174,8 +304,80 @@ public:
             });
     }
 
+    void start_read_stdin_datagram(mux::channel_id_t id, std::size_t bytes_transferred)
+    {
+        BOOST_LOG_TRIVIAL(trace) << "[remote] start_read_stdin_datagram: " << id << ", " << bytes_transferred;
+        mux::chunk_ptr buf = std::make_shared<mux::chunk>(bytes_transferred);
+        std::shared_ptr<datagram_connection<server>> conn;
+        if (not datagram_targets_.empty())
+        {
+            auto it = datagram_used_.find(id);
+            if (it == datagram_used_.end())
+            {
+                conn = std::make_shared<datagram_connection<server>>(io_context_, id, *this);
+                if (conn->connect(*datagram_targets_.begin()))
+                    datagram_used_.insert({id, conn});
+                else
+                    conn.reset();
+            }
+            else
+                conn = it->second;
+        }
+        else if (not warned_no_datagram_target_)
+        {
+            BOOST_LOG_TRIVIAL(warning) << "[remote] datagram channel " << id << " but no --udp-to given, dropping datagrams";
+            warned_no_datagram_target_ = true;
+        }
+
+        boost::asio::async_read(
+            stdin_,
+            boost::asio::buffer(buf->data(), buf->size()),
+            [buf, conn, this] (boost::system::error_code const & error,
+                               std::size_t bytes_transferred) {
+                if (error)
+                {
+                    if (not mux::is_common_error(error))
+                        BOOST_LOG_TRIVIAL(error) << "[remote] start_read_stdin_datagram error: " << error.message() ;
+                    close();
+                }
+                else
+                {
+                    if (conn)
+                        conn->post(buf);
+                    start_read_stdin();
+                }
+            });
+    }
+
+    void start_expire_datagram()
+    {
+        datagram_timer_.expires_after(datagram_timeout_);
+        datagram_timer_.async_wait(
+            [this] (boost::system::error_code const & error) {
+                if (error)
+                    return;
+
+                auto deadline = std::chrono::steady_clock::now() - datagram_timeout_;
+                for (auto it = datagram_used_.begin(); it != datagram_used_.end();)
+                {
+                    if (it->second->last_active() < deadline)
+                    {
+                        BOOST_LOG_TRIVIAL(trace) << "[remote] expired datagram channel: " << it->first;
+                        it->second->close();
+                        it = datagram_used_.erase(it);
+                    }
+                    else
+                        ++it;
+                }
+                start_expire_datagram();
+            });
+    }
+
     void post(mux::chunk_ptr chk) { managed_stream_->post(chk); }
 
+    auto pick() -> mux::backend_ptr { return balancer_.pick(); }
+    auto backend_count() -> std::size_t { return balancer_.size(); }
+
     void remove_channel(mux::channel_id_t id)
     {
         channel_used_.erase(id);
@@ -184,7 +386,15 @@ public:
     void close()
     {
         BOOST_LOG_TRIVIAL(info) << "[remote] closed";
-        boost::asio::post(io_context_, [this] { stdin_.close(); });
+        boost::asio::post(io_context_,
+                          [this] {
+                              stdin_.close();
+                              balancer_.stop();
+                              datagram_timer_.cancel();
+                              for (auto & p : datagram_used_)
+                                  p.second->close();
+                              datagram_used_.clear();
+                          });
     }
 };
 
@@ -195,11 +405,18 @@ int main(int argc, char* argv[])
     mux::init_log();
     try
     {
-        std::string target;
+        std::vector<std::string> targets;
+        std::string balance, datagram_target;
+        int resolve_interval, health_interval, datagram_timeout;
         po::options_description desc("Allowed options");
         desc.add_options()
             ("help", "produce help message")
-            ("to", po::value<std::string>(&target)->required(), "connect to this host:port")
+            ("to", po::value<std::vector<std::string>>(&targets)->multitoken()->required(), "connect to these host:port backends")
+            ("balance", po::value<std::string>(&balance)->default_value("least-conn"), "pick a backend per channel by least-conn or latency (EWMA connect time)")
+            ("health-interval", po::value<int>(&health_interval)->default_value(5), "seconds between backend health checks, 0 to disable")
+            ("udp-to", po::value<std::string>(&datagram_target), "forward datagram channels to this udp host:port")
+            ("udp-timeout", po::value<int>(&datagram_timeout)->default_value(30), "seconds before an idle datagram channel is closed")
+            ("resolve-interval", po::value<int>(&resolve_interval)->default_value(60), "seconds to cache resolved backend addresses, 0 to resolve once")
             ;
 
         po::positional_options_description p;
@@ -214,15 +431,33 @@ int main(int argc, char* argv[])
         }
 
         po::notify(vm);
+        if (datagram_timeout <= 0)
+            throw std::invalid_argument("--udp-timeout must be positive");
 
-        std::vector<std::string> result;
-        boost::split(result, target, boost::is_any_of(":"));
         boost::asio::io_context io;
 
-        boost::asio::ip::tcp::resolver resolver{io};
-        auto endpoints = resolver.resolve(result.at(0), result.at(1));
+        mux::balancer balancer {mux::balancer::parse_policy(balance)};
+        for (std::string const & target : targets)
+        {
+            std::vector<std::string> result;
+            boost::split(result, target, boost::is_any_of(":"));
+
+            auto b = std::make_shared<mux::backend>(io, result.at(0), result.at(1));
+            b->start(std::chrono::seconds{resolve_interval}, std::chrono::seconds{health_interval});
+            balancer.add(b);
+        }
+
+        boost::asio::ip::udp::resolver::results_type datagram_targets;
+        if (not datagram_target.empty())
+        {
+            std::vector<std::string> result;
+            boost::split(result, datagram_target, boost::is_any_of(":"));
+
+            boost::asio::ip::udp::resolver resolver{io};
+            datagram_targets = resolver.resolve(result.at(0), result.at(1));
+        }
 
-        server s {io, endpoints};
+        server s {io, balancer, datagram_targets, std::chrono::seconds{datagram_timeout}};
 
         io.run();
 